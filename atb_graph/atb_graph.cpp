@@ -1,5 +1,15 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <future>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include "acl/acl.h"
@@ -33,29 +43,612 @@ atb::Tensor genTensor(const std::vector<int64_t>& dims, aclDataType dtype, aclFo
     return tensor;
 }
 
-class AtbGraph {
+uint64_t tensorBytes(const atb::TensorDesc& desc) {
+    uint64_t nums = 1;
+    for (uint64_t i = 0; i < desc.shape.dimNum; ++i) {
+        nums *= static_cast<uint64_t>(desc.shape.dims[i]);
+    }
+    return nums * aclDataTypeSize(desc.dtype);
+}
+
+enum class NodeKind { MATMUL, ELEWISE, LINEAR };
+
+// a graph node before its operation is created, so passes can still rewrite it
+struct NodeDesc {
+    NodeKind kind = NodeKind::MATMUL;
+    atb::infer::MatmulParam matmul;
+    atb::infer::ElewiseParam elewise;
+    atb::infer::LinearParam linear;
+    std::vector<uint32_t> inTensorIds;
+    std::vector<uint32_t> outTensorIds;
+};
+
+// mirrors atb::GraphParam, tensor ids are in, out, then internal tensors
+struct GraphDesc {
+    uint32_t inTensorNum = 0;
+    uint32_t outTensorNum = 0;
+    uint32_t internalTensorNum = 0;
+    std::vector<NodeDesc> nodes;
+    std::vector<atb::TensorDesc> tensorDescs;  // indexed by tensor id
+};
+
+struct FusionReport {
+    int fused = 0;
+    int launchesSaved = 0;
+    uint64_t bytesSaved = 0;  // intermediate writes plus re-reads avoided
+};
+
+// bias of a linear is [n] or [1, n] against a [m, n] result. Only fp16 is
+// fused: atb's Linear wants a float32 bias for bf16 inputs, which an add of
+// two bf16 tensors never has.
+bool isBiasOf(const atb::TensorDesc& bias, const atb::TensorDesc& result) {
+    if (result.dtype != ACL_FLOAT16 || bias.dtype != ACL_FLOAT16 || result.shape.dimNum == 0) {
+        return false;
+    }
+    int64_t n = result.shape.dims[result.shape.dimNum - 1];
+    if (bias.shape.dimNum == 1) {
+        return bias.shape.dims[0] == n;
+    }
+    return bias.shape.dimNum == 2 && bias.shape.dims[0] == 1 && bias.shape.dims[1] == n;
+}
+
+// drops an internal tensor and shifts the ids of the internal tensors after it
+void removeInternalTensor(GraphDesc& desc, uint32_t id) {
+    for (auto& node : desc.nodes) {
+        for (auto& in : node.inTensorIds) {
+            if (in > id) {
+                --in;
+            }
+        }
+        for (auto& out : node.outTensorIds) {
+            if (out > id) {
+                --out;
+            }
+        }
+    }
+    desc.tensorDescs.erase(desc.tensorDescs.begin() + id);
+    --desc.internalTensorNum;
+}
+
+// Rewrites matmul -> add(bias) into one Linear node with hasBias. The matmul
+// result must be internal, consumed only by the add, and the other add operand
+// a graph input shaped like a bias. Mul and cast epilogues have no fused form
+// in atb's Linear, so those chains are left alone.
+FusionReport fuseMatmulEpilogue(GraphDesc& desc) {
+    FusionReport report;
+    uint32_t firstInternal = desc.inTensorNum + desc.outTensorNum;
+
+    size_t i = 0;
+    while (i < desc.nodes.size()) {
+        const NodeDesc& mm = desc.nodes[i];
+        if (mm.kind != NodeKind::MATMUL || mm.outTensorIds.size() != 1 || mm.outTensorIds[0] < firstInternal) {
+            ++i;
+            continue;
+        }
+        uint32_t mid = mm.outTensorIds[0];
+
+        int uses = 0;
+        size_t consumer = 0;
+        for (size_t j = 0; j < desc.nodes.size(); ++j) {
+            for (auto id : desc.nodes[j].inTensorIds) {
+                if (id == mid) {
+                    ++uses;
+                    consumer = j;
+                }
+            }
+        }
+        const NodeDesc& ew = desc.nodes[consumer];
+        if (uses != 1 || ew.kind != NodeKind::ELEWISE ||
+            ew.elewise.elewiseType != atb::infer::ElewiseParam::ELEWISE_ADD || ew.inTensorIds.size() != 2) {
+            ++i;
+            continue;
+        }
+        uint32_t bias = ew.inTensorIds[0] == mid ? ew.inTensorIds[1] : ew.inTensorIds[0];
+        if (bias >= desc.inTensorNum || !isBiasOf(desc.tensorDescs[bias], desc.tensorDescs[mid])) {
+            ++i;
+            continue;
+        }
+
+        NodeDesc linear;
+        linear.kind = NodeKind::LINEAR;
+        linear.linear.transposeA = mm.matmul.transposeA;
+        linear.linear.transposeB = mm.matmul.transposeB;
+        linear.linear.hasBias = true;
+        linear.inTensorIds = {mm.inTensorIds[0], mm.inTensorIds[1], bias};
+        linear.outTensorIds = ew.outTensorIds;
+
+        // the add sits after the matmul, so its slot keeps the fused node in
+        // topological order
+        report.bytesSaved += 2 * tensorBytes(desc.tensorDescs[mid]);
+        desc.nodes[consumer] = linear;
+        desc.nodes.erase(desc.nodes.begin() + i);
+        removeInternalTensor(desc, mid);
+        ++report.fused;
+        ++report.launchesSaved;
+    }
+    return report;
+}
+
+// FNV-1a over the raw weight bytes, used to spot identical weights
+uint64_t hashBytes(const void* data, uint64_t size) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    uint64_t hash = 14695981039346656037ULL;
+    for (uint64_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+struct WeightEntry {
+    uint64_t hash = 0;
+    uint64_t size = 0;
+    std::vector<uint8_t> host;           // lazy source or offloaded copy, guarded by the registry mutex
+    std::atomic<void*> device{nullptr};
+    std::atomic<int> pins{0};            // runs reading device, -1 while it is being offloaded
+    std::atomic<uint64_t> last_use{0};
+    int refs = 0;                        // registered names plus live handles, guarded by the registry mutex
+};
+
+// Process wide weight store. Each distinct weight (same size and bytes) is
+// uploaded once no matter how many names or graphs refer to it. Under a
+// device budget, unpinned weights are offloaded to host in LRU order and
+// uploaded again on their next pin.
+//
+// Pinning a resident weight is lock free so dispatchers do not serialise on
+// the registry; the mutex is only taken to upload, offload or register.
+class WeightRegistry {
   public:
-    explicit AtbGraph(void* _outter_workspace, void* outter_stream) : outter_workspace(_outter_workspace), stream(outter_stream) {
-        int ret = atb::CreateContext(&context);
+    static WeightRegistry& instance() {
+        static WeightRegistry registry;
+        return registry;
+    }
+
+    // 0 means no limit
+    void setBudget(uint64_t bytes) {
+        std::unique_lock<std::mutex> lock(mutex);
+        budget = bytes;
+        makeRoom(lock, 0);
+    }
+
+    int add(const std::string& name, const void* host_data, uint64_t size, bool lazy) {
+        if (host_data == nullptr || size == 0) {
+            std::cout << "register weight " << name << " without data" << std::endl;
+            return -1;
+        }
+        uint64_t hash = hashBytes(host_data, size);
+
+        // registrations are serialised, so names cannot change under us while
+        // mutex is dropped for an offload or an upload
+        std::lock_guard<std::mutex> registering(registration);
+        std::unique_lock<std::mutex> lock(mutex);
+        auto named = by_name.find(name);
+        if (named != by_name.end()) {
+            if (sameContent(lock, named->second, host_data, hash, size)) {
+                return 0;
+            }
+            std::cout << "weight " << name << " already registered with different content" << std::endl;
+            return -1;
+        }
+
+        // candidates are held so none is freed while the lock is dropped
+        std::vector<WeightEntry*> candidates;
+        auto bucket = by_hash.find(hash);
+        if (bucket != by_hash.end()) {
+            candidates = bucket->second;
+        }
+        for (WeightEntry* entry : candidates) {
+            ++entry->refs;
+        }
+        WeightEntry* found = nullptr;
+        for (WeightEntry* entry : candidates) {
+            if (found == nullptr && sameContent(lock, entry, host_data, hash, size)) {
+                found = entry;
+            } else {
+                releaseLocked(entry);
+            }
+        }
+        if (found != nullptr) {
+            by_name[name] = found;  // keeps the ref taken above
+            return 0;
+        }
+
+        WeightEntry* entry = new WeightEntry();
+        entry->hash = hash;
+        entry->size = size;
+        entry->refs = 1;
+        if (lazy) {
+            const uint8_t* bytes = static_cast<const uint8_t*>(host_data);
+            entry->host.assign(bytes, bytes + size);
+        } else if (upload(lock, entry, host_data) != 0) {
+            delete entry;
+            return -1;
+        }
+        by_hash[hash].push_back(entry);
+        by_name[name] = entry;
+        return 0;
+    }
+
+    int remove(const std::string& name) {
+        std::lock_guard<std::mutex> registering(registration);
+        std::lock_guard<std::mutex> lock(mutex);
+        auto named = by_name.find(name);
+        if (named == by_name.end()) {
+            return -1;
+        }
+        WeightEntry* entry = named->second;
+        by_name.erase(named);
+        releaseLocked(entry);
+        return 0;
+    }
+
+    // +1 ref, nullptr if name is unknown
+    WeightEntry* acquire(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto named = by_name.find(name);
+        if (named == by_name.end()) {
+            return nullptr;
+        }
+        ++named->second->refs;
+        return named->second;
+    }
+
+    void retain(WeightEntry* entry) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++entry->refs;
+    }
+
+    void release(WeightEntry* entry) {
+        std::lock_guard<std::mutex> lock(mutex);
+        releaseLocked(entry);
+    }
+
+    // makes entry resident and keeps it there until unpin
+    void* pin(WeightEntry* entry) {
+        // an offload needs pins at 0, so once our increment lands device
+        // stays put; it is re-read because an offload may have finished
+        // between the check and the increment
+        int pins = entry->pins.load();
+        while (pins >= 0 && entry->device.load() != nullptr) {
+            if (entry->pins.compare_exchange_weak(pins, pins + 1)) {
+                void* device = entry->device.load();
+                if (device != nullptr) {
+                    entry->last_use.store(++tick, std::memory_order_relaxed);
+                    return device;
+                }
+                entry->pins.fetch_sub(1);
+                break;
+            }
+        }
+        return pinSlow(entry);
+    }
+
+    void unpin(WeightEntry* entry) {
+        // only trim here when an earlier upload had to overshoot the budget
+        if (entry->pins.fetch_sub(1) == 1 && over_budget.load(std::memory_order_relaxed)) {
+            std::unique_lock<std::mutex> lock(mutex);
+            makeRoom(lock, 0);
+        }
+    }
+
+  private:
+    // upload drops the lock inside makeRoom, and meanwhile another dispatcher
+    // may upload, run and unpin this entry and a third makeRoom claim it for
+    // offload. So the claim is checked again after every upload and the pin
+    // only lands by a CAS from >= 0 while device is set.
+    void* pinSlow(WeightEntry* entry) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            offload_cv.wait(lock, [&]() { return entry->pins.load() != -1; });
+            void* device = entry->device.load();
+            if (device != nullptr) {
+                int pins = entry->pins.load();
+                while (pins >= 0) {
+                    if (entry->pins.compare_exchange_weak(pins, pins + 1)) {
+                        entry->last_use.store(++tick, std::memory_order_relaxed);
+                        return device;
+                    }
+                }
+                continue;
+            }
+            if (upload(lock, entry, nullptr) != 0) {
+                return nullptr;
+            }
+        }
+    }
+
+    // compares against the host copy, or reads the device copy back when the
+    // weight was uploaded without keeping one
+    bool sameContent(std::unique_lock<std::mutex>& lock, WeightEntry* entry, const void* host_data,
+                     uint64_t hash, uint64_t size) {
+        if (entry->hash != hash || entry->size != size) {
+            return false;
+        }
+        offload_cv.wait(lock, [&]() { return entry->pins.load() != -1; });
+        if (!entry->host.empty()) {
+            return std::memcmp(entry->host.data(), host_data, size) == 0;
+        }
+        std::vector<uint8_t> bytes(size);
+        int ret = aclrtMemcpy(bytes.data(), size, entry->device.load(), size, ACL_MEMCPY_DEVICE_TO_HOST);
         if (ret != 0) {
-            std::cout << "atb::CreateContext faield, ret: " << ret << std::endl;
+            std::cout << "weight compare aclrtMemcpy failed, ret: " << ret << std::endl;
+            return false;
         }
-    
-        if (stream == nullptr) {
-            ret = aclrtCreateStream(&stream);
+        return std::memcmp(bytes.data(), host_data, size) == 0;
+    }
+
+    // src nullptr uploads from the entry's host copy
+    int upload(std::unique_lock<std::mutex>& lock, WeightEntry* entry, const void* src) {
+        makeRoom(lock, entry->size);
+        if (entry->device.load() != nullptr) {
+            return 0;  // uploaded by another pin while makeRoom dropped the lock, the caller re-checks its claim
+        }
+        if (src == nullptr) {
+            src = entry->host.data();
+        }
+        void* device = nullptr;
+        int ret = aclrtMalloc(&device, entry->size, ACL_MEM_MALLOC_HUGE_FIRST);
+        if (ret != 0) {
+            std::cout << "weight aclrtMalloc failed, ret: " << ret << std::endl;
+            return ret;
+        }
+        ret = aclrtMemcpy(device, entry->size, src, entry->size, ACL_MEMCPY_HOST_TO_DEVICE);
+        if (ret != 0) {
+            std::cout << "weight aclrtMemcpy failed, ret: " << ret << std::endl;
+            aclrtFree(device);
+            return ret;
+        }
+        entry->device.store(device);
+        resident += entry->size;
+        if (budget != 0 && resident > budget) {
+            over_budget.store(true);
+        }
+        return 0;
+    }
+
+    // Offloads least recently used unpinned weights until size more bytes
+    // fit. The victim is claimed by moving its pins to -1, then the D2H copy
+    // and free run with the lock dropped so pins of other weights go on.
+    void makeRoom(std::unique_lock<std::mutex>& lock, uint64_t size) {
+        while (budget != 0 && resident + size > budget) {
+            WeightEntry* victim = nullptr;
+            for (auto& bucket : by_hash) {
+                for (WeightEntry* entry : bucket.second) {
+                    if (entry->device.load() != nullptr && entry->pins.load() == 0 &&
+                        (victim == nullptr || entry->last_use.load() < victim->last_use.load())) {
+                        victim = entry;
+                    }
+                }
+            }
+            if (victim == nullptr) {
+                if (size > 0) {
+                    std::cout << "weight budget " << budget << " exceeded by pinned weights" << std::endl;
+                }
+                over_budget.store(true);
+                return;
+            }
+            int idle = 0;
+            if (!victim->pins.compare_exchange_strong(idle, -1)) {
+                continue;  // pinned since the scan
+            }
+            ++victim->refs;
+            bool need_copy = victim->host.empty();
+            void* device = victim->device.load();
+            lock.unlock();
+
+            std::vector<uint8_t> host;
+            int ret = 0;
+            if (need_copy) {
+                host.resize(victim->size);
+                ret = aclrtMemcpy(host.data(), victim->size, device, victim->size, ACL_MEMCPY_DEVICE_TO_HOST);
+            }
+            if (ret == 0) {
+                aclrtFree(device);
+            }
+
+            lock.lock();
+            if (ret == 0) {
+                if (need_copy) {
+                    victim->host.swap(host);
+                }
+                victim->device.store(nullptr);
+                resident -= victim->size;
+            } else {
+                std::cout << "weight offload aclrtMemcpy failed, ret: " << ret << std::endl;
+            }
+            victim->pins.store(0);
+            offload_cv.notify_all();
+            releaseLocked(victim);
             if (ret != 0) {
-                std::cout << "aclrtCreateStream faield, ret: " << ret << std::endl;
+                over_budget.store(true);
+                return;
             }
         }
-        context->SetExecuteStream(stream);
+        over_budget.store(false);
+    }
 
-        if (outter_workspace != nullptr) {
-            workspace = outter_workspace;
+    void releaseLocked(WeightEntry* entry) {
+        if (--entry->refs > 0) {
+            return;
+        }
+        void* device = entry->device.load();
+        if (device != nullptr) {
+            aclrtFree(device);
+            resident -= entry->size;
+        }
+        auto& bucket = by_hash[entry->hash];
+        bucket.erase(std::find(bucket.begin(), bucket.end(), entry));
+        if (bucket.empty()) {
+            by_hash.erase(entry->hash);
+        }
+        delete entry;
+    }
+
+    std::mutex registration;
+    std::mutex mutex;
+    std::condition_variable offload_cv;
+    std::unordered_map<std::string, WeightEntry*> by_name;
+    std::unordered_map<uint64_t, std::vector<WeightEntry*>> by_hash;
+    uint64_t budget = 0;
+    uint64_t resident = 0;
+    std::atomic<bool> over_budget{false};
+    std::atomic<uint64_t> tick{0};
+};
+
+// refcounted reference to a registered weight, what graphs hold on to
+class WeightHandle {
+  public:
+    WeightHandle() = default;
+    explicit WeightHandle(WeightEntry* _entry) : entry(_entry) {}  // adopts the ref from acquire
+    WeightHandle(const WeightHandle& other) : entry(other.entry) {
+        if (entry != nullptr) {
+            WeightRegistry::instance().retain(entry);
+        }
+    }
+    WeightHandle& operator=(WeightHandle other) {
+        std::swap(entry, other.entry);
+        return *this;
+    }
+    ~WeightHandle() {
+        if (entry != nullptr) {
+            WeightRegistry::instance().release(entry);
+        }
+    }
+
+    explicit operator bool() const { return entry != nullptr; }
+    uint64_t size() const { return entry->size; }
+    void* pin() const { return WeightRegistry::instance().pin(entry); }
+    void unpin() const { WeightRegistry::instance().unpin(entry); }
+
+  private:
+    WeightEntry* entry = nullptr;
+};
+
+// one run() call in flight, lives on the caller's stack until done is fulfilled
+struct RunRequest {
+    std::atomic<RunRequest*> next{nullptr};
+    void** inputs = nullptr;
+    int input_size = 0;
+    void** outputs = nullptr;
+    int output_size = 0;
+    std::promise<int> done;
+};
+
+// Vyukov intrusive MPSC queue: push is a single atomic exchange, so any number
+// of caller threads submit without a lock; only the owning dispatcher pops.
+class MpscQueue {
+  public:
+    MpscQueue() : head(&stub), tail(&stub) {}
+
+    void push(RunRequest* req) {
+        req->next.store(nullptr, std::memory_order_relaxed);
+        RunRequest* prev = head.exchange(req, std::memory_order_seq_cst);
+        prev->next.store(req, std::memory_order_release);
+    }
+
+    RunRequest* pop() {
+        RunRequest* t = tail;
+        RunRequest* next = t->next.load(std::memory_order_acquire);
+        if (t == &stub) {
+            if (next == nullptr) {
+                return nullptr;
+            }
+            tail = next;
+            t = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next != nullptr) {
+            tail = next;
+            return t;
+        }
+        // a producer swapped head but has not linked its node yet
+        if (t != head.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        push(&stub);
+        next = t->next.load(std::memory_order_acquire);
+        if (next != nullptr) {
+            tail = next;
+            return t;
+        }
+        return nullptr;
+    }
+
+  private:
+    RunRequest stub;
+    std::atomic<RunRequest*> head;
+    RunRequest* tail;
+};
+
+// everything one dispatcher thread needs to run the graph without touching
+// another thread's state: its own graph operation, context, stream,
+// workspace and variant pack copy
+struct ExecSlot {
+    atb::Operation *graph = nullptr;
+    atb::Context *context = nullptr;
+    void *stream = nullptr;
+    bool own_stream = false;
+    void *workspace = nullptr;
+    bool own_workspace = false;
+    uint64_t workspaceSize = 0;
+    atb::VariantPack variant_pack;
+
+    MpscQueue queue;
+    std::thread dispatcher;
+    std::atomic<bool> parked{false};
+    std::mutex park_mutex;
+    std::condition_variable park_cv;
+};
+
+class AtbGraph {
+  public:
+    explicit AtbGraph(void* outter_workspace, void* outter_stream, int num_slots = 1, bool _with_bias = false)
+        : with_bias(_with_bias) {
+        int ret = aclrtGetCurrentContext(&device_context);
+        if (ret != 0) {
+            std::cout << "aclrtGetCurrentContext faield, ret: " << ret << std::endl;
+        }
+
+        if (num_slots < 1) {
+            num_slots = 1;
+        }
+        for (int i = 0; i < num_slots; ++i) {
+            std::unique_ptr<ExecSlot> slot(new ExecSlot());
+
+            ret = atb::CreateContext(&slot->context);
+            if (ret != 0) {
+                std::cout << "atb::CreateContext faield, ret: " << ret << std::endl;
+            }
+
+            // the outer stream and workspace can only back a single slot,
+            // every other slot gets its own so they never alias
+            if (i == 0 && outter_stream != nullptr) {
+                slot->stream = outter_stream;
+            } else {
+                ret = aclrtCreateStream(&slot->stream);
+                if (ret != 0) {
+                    std::cout << "aclrtCreateStream faield, ret: " << ret << std::endl;
+                }
+                slot->own_stream = true;
+            }
+            slot->context->SetExecuteStream(slot->stream);
+
+            // only slot 0 can use the caller's workspace, every other slot
+            // allocates and grows its own
+            slot->own_workspace = (i != 0 || outter_workspace == nullptr);
+            if (!slot->own_workspace) {
+                slot->workspace = outter_workspace;
+            }
+            slots.push_back(std::move(slot));
         }
         build();
     }
 
-    void build() {
+    GraphDesc describeGraph() {
+        if (with_bias) {
+            return describeBiasGraph();
+        }
+
         // a1: 1, 4096 b1: 4096, 4096     a2: 1, 4096  b2: 4096, 4096
         //       \             /               \               /
         //         mm1: 1, 4096                    mm2: 1, 4096
@@ -63,136 +656,429 @@ class AtbGraph {
         //                \                             /
         //                 \                           /
         //                  \                         /
-        //                       add: 1, 4096 
+        //                       add: 1, 4096
 
-        // mm1
         std::vector<int64_t> a1_shape {1, 4096};
         std::vector<int64_t> b1_shape {4096, 4096};
-        auto a1 = genTensor(a1_shape, ACL_FLOAT16, ACL_FORMAT_ND, nullptr, nullptr);
-        auto b1 = genTensor(b1_shape, ACL_FLOAT16, ACL_FORMAT_ND, nullptr, nullptr);
-
-        atb::infer::MatmulParam mm1_param;
-        mm1_param.transposeA = false;
-        mm1_param.transposeB = false;
-        atb::Operation *mm1_op = nullptr;
-        atb::Status st = atb::CreateOperation(mm1_param, &mm1_op);
-        if (st != 0) {
-            std::cout << "atb CreateOperation mm1 failed, st: " << st << std::endl;
-        }
-
-        // mm2
         std::vector<int64_t> a2_shape {1, 4096};
         std::vector<int64_t> b2_shape {4096, 4096};
-        auto a2 = genTensor(a2_shape, ACL_FLOAT16, ACL_FORMAT_ND, nullptr, nullptr);
-        auto b2 = genTensor(b2_shape, ACL_FLOAT16, ACL_FORMAT_ND, nullptr, nullptr);
-
-        atb::infer::MatmulParam mm2_param;
-        mm2_param.transposeA = false;
-        mm2_param.transposeB = false;
-        atb::Operation *mm2_op = nullptr;
-        st = atb::CreateOperation(mm2_param, &mm2_op);
-        if (st != 0) {
-            std::cout << "atb CreateOperation mm2 failed, st: " << st << std::endl;
-        }
+        std::vector<int64_t> out_shape {1, 4096};
+        std::vector<int64_t> mm1_shape {1, 4096};
+        std::vector<int64_t> mm2_shape {1, 4096};
+
+        GraphDesc desc;
+        desc.inTensorNum = 4;
+        desc.outTensorNum = 1;
+        desc.internalTensorNum = 2;
+        desc.tensorDescs.push_back(genTensor(a1_shape, ACL_FLOAT16, ACL_FORMAT_ND, nullptr, nullptr).desc);   // 0
+        desc.tensorDescs.push_back(genTensor(b1_shape, ACL_FLOAT16, ACL_FORMAT_ND, nullptr, nullptr).desc);   // 1
+        desc.tensorDescs.push_back(genTensor(a2_shape, ACL_FLOAT16, ACL_FORMAT_ND, nullptr, nullptr).desc);   // 2
+        desc.tensorDescs.push_back(genTensor(b2_shape, ACL_FLOAT16, ACL_FORMAT_ND, nullptr, nullptr).desc);   // 3
+        desc.tensorDescs.push_back(genTensor(out_shape, ACL_FLOAT16, ACL_FORMAT_ND, nullptr, nullptr).desc);  // 4
+        desc.tensorDescs.push_back(genTensor(mm1_shape, ACL_FLOAT16, ACL_FORMAT_ND, nullptr, nullptr).desc);  // 5
+        desc.tensorDescs.push_back(genTensor(mm2_shape, ACL_FLOAT16, ACL_FORMAT_ND, nullptr, nullptr).desc);  // 6
+
+        // mm1
+        NodeDesc mm1;
+        mm1.kind = NodeKind::MATMUL;
+        mm1.matmul.transposeA = false;
+        mm1.matmul.transposeB = false;
+        mm1.inTensorIds = {0, 1};
+        mm1.outTensorIds = {5};
+        desc.nodes.push_back(mm1);
+
+        // mm2
+        NodeDesc mm2;
+        mm2.kind = NodeKind::MATMUL;
+        mm2.matmul.transposeA = false;
+        mm2.matmul.transposeB = false;
+        mm2.inTensorIds = {2, 3};
+        mm2.outTensorIds = {6};
+        desc.nodes.push_back(mm2);
 
         // add
+        NodeDesc add;
+        add.kind = NodeKind::ELEWISE;
+        add.elewise.elewiseType = atb::infer::ElewiseParam::ELEWISE_ADD;
+        add.inTensorIds = {5, 6};
+        add.outTensorIds = {4};
+        desc.nodes.push_back(add);
+        return desc;
+    }
+
+    GraphDesc describeBiasGraph() {
+        // a1: 1, 4096 b1: 4096, 4096
+        //       \             /
+        //         mm1: 1, 4096    bias: 4096     a2: 1, 4096  b2: 4096, 4096
+        //               \         /                \               /
+        //             mm1_bias: 1, 4096                 mm2: 1, 4096
+        //                     \                           /
+        //                           add: 1, 4096
+        //
+        // mm1 -> mm1_bias is fused into a Linear; mm2 feeds an add of two
+        // internal tensors and stays as it is
+
+        std::vector<int64_t> a_shape {1, 4096};
+        std::vector<int64_t> b_shape {4096, 4096};
+        std::vector<int64_t> bias_shape {4096};
         std::vector<int64_t> out_shape {1, 4096};
-        auto out = genTensor(out_shape, ACL_FLOAT16, ACL_FORMAT_ND, nullptr, nullptr);
 
-        atb::infer::ElewiseParam addParam;
-        addParam.elewiseType =  atb::infer::ElewiseParam::ELEWISE_ADD;
-        atb::Operation *add_op = nullptr;
-        st = atb::CreateOperation(addParam, &add_op);
-        if (st != 0) {
-            std::cout << "atb CreateOperation add failed, st: " << st << std::endl;
-        }
+        GraphDesc desc;
+        desc.inTensorNum = 5;
+        desc.outTensorNum = 1;
+        desc.internalTensorNum = 3;
+        desc.tensorDescs.push_back(genTensor(a_shape, ACL_FLOAT16, ACL_FORMAT_ND, nullptr, nullptr).desc);     // 0 a1
+        desc.tensorDescs.push_back(genTensor(b_shape, ACL_FLOAT16, ACL_FORMAT_ND, nullptr, nullptr).desc);     // 1 b1
+        desc.tensorDescs.push_back(genTensor(a_shape, ACL_FLOAT16, ACL_FORMAT_ND, nullptr, nullptr).desc);     // 2 a2
+        desc.tensorDescs.push_back(genTensor(b_shape, ACL_FLOAT16, ACL_FORMAT_ND, nullptr, nullptr).desc);     // 3 b2
+        desc.tensorDescs.push_back(genTensor(bias_shape, ACL_FLOAT16, ACL_FORMAT_ND, nullptr, nullptr).desc);  // 4 bias
+        desc.tensorDescs.push_back(genTensor(out_shape, ACL_FLOAT16, ACL_FORMAT_ND, nullptr, nullptr).desc);   // 5 out
+        desc.tensorDescs.push_back(genTensor(out_shape, ACL_FLOAT16, ACL_FORMAT_ND, nullptr, nullptr).desc);   // 6 mm1
+        desc.tensorDescs.push_back(genTensor(out_shape, ACL_FLOAT16, ACL_FORMAT_ND, nullptr, nullptr).desc);   // 7 mm1_bias
+        desc.tensorDescs.push_back(genTensor(out_shape, ACL_FLOAT16, ACL_FORMAT_ND, nullptr, nullptr).desc);   // 8 mm2
+
+        NodeDesc mm1;
+        mm1.kind = NodeKind::MATMUL;
+        mm1.inTensorIds = {0, 1};
+        mm1.outTensorIds = {6};
+        desc.nodes.push_back(mm1);
+
+        NodeDesc add_bias;
+        add_bias.kind = NodeKind::ELEWISE;
+        add_bias.elewise.elewiseType = atb::infer::ElewiseParam::ELEWISE_ADD;
+        add_bias.inTensorIds = {6, 4};
+        add_bias.outTensorIds = {7};
+        desc.nodes.push_back(add_bias);
 
-        // graph
+        NodeDesc mm2;
+        mm2.kind = NodeKind::MATMUL;
+        mm2.inTensorIds = {2, 3};
+        mm2.outTensorIds = {8};
+        desc.nodes.push_back(mm2);
+
+        NodeDesc add;
+        add.kind = NodeKind::ELEWISE;
+        add.elewise.elewiseType = atb::infer::ElewiseParam::ELEWISE_ADD;
+        add.inTensorIds = {7, 8};
+        add.outTensorIds = {5};
+        desc.nodes.push_back(add);
+        return desc;
+    }
+
+    atb::Operation* createGraph(const GraphDesc& desc) {
         atb::GraphParam graph_param;
-        graph_param.inTensorNum = 4;
-        graph_param.outTensorNum = 1;
-        graph_param.internalTensorNum = 2;
-        graph_param.nodes.resize(3);
-
-        graph_param.nodes[0].operation = mm1_op;
-        graph_param.nodes[0].inTensorIds = {0, 1};
-        graph_param.nodes[0].outTensorIds = {5};
-        graph_param.nodes[1].operation = mm2_op;
-        graph_param.nodes[1].inTensorIds = {2, 3};
-        graph_param.nodes[1].outTensorIds = {6};
-        graph_param.nodes[2].operation = add_op;
-        graph_param.nodes[2].inTensorIds = {5, 6};
-        graph_param.nodes[2].outTensorIds = {4};
-
-        variant_pack.inTensors.push_back(a1);  // 0
-        variant_pack.inTensors.push_back(b1);  // 1
-        variant_pack.inTensors.push_back(a2);  // 2
-        variant_pack.inTensors.push_back(b2);  // 3
-        variant_pack.outTensors.push_back(out); // 4
-
-        st = atb::CreateOperation(graph_param, &graph);
+        graph_param.inTensorNum = desc.inTensorNum;
+        graph_param.outTensorNum = desc.outTensorNum;
+        graph_param.internalTensorNum = desc.internalTensorNum;
+        graph_param.nodes.resize(desc.nodes.size());
+
+        atb::Status st = 0;
+        for (size_t i = 0; i < desc.nodes.size(); ++i) {
+            const NodeDesc& node = desc.nodes[i];
+            atb::Operation *op = nullptr;
+            switch (node.kind) {
+                case NodeKind::MATMUL:
+                    st = atb::CreateOperation(node.matmul, &op);
+                    break;
+                case NodeKind::ELEWISE:
+                    st = atb::CreateOperation(node.elewise, &op);
+                    break;
+                case NodeKind::LINEAR:
+                    st = atb::CreateOperation(node.linear, &op);
+                    break;
+            }
+            if (st != 0) {
+                std::cout << "atb CreateOperation node " << i << " failed, st: " << st << std::endl;
+            }
+
+            graph_param.nodes[i].operation = op;
+            for (auto id : node.inTensorIds) {
+                graph_param.nodes[i].inTensorIds.push_back(id);
+            }
+            for (auto id : node.outTensorIds) {
+                graph_param.nodes[i].outTensorIds.push_back(id);
+            }
+        }
+
+        atb::Operation *graph_op = nullptr;
+        st = atb::CreateOperation(graph_param, &graph_op);
         if (st != 0) {
             std::cout << "atb CreateOperation graph failed, st: " << st << std::endl;
         }
+        return graph_op;
+    }
 
-        st = graph->Setup(variant_pack, workspaceSize);
-        if (st == 0) {
-            std::cout << "graph work space size: " << workspaceSize << std::endl;
-        } else {
-            std::cout << "graph setup failed, st: " << st << std::endl;
+    void build() {
+        GraphDesc desc = describeGraph();
+        fusion_report = fuseMatmulEpilogue(desc);
+        std::cout << "epilogue fusion: fused " << fusion_report.fused
+                  << ", launches saved " << fusion_report.launchesSaved
+                  << ", intermediate bytes saved " << fusion_report.bytesSaved << std::endl;
+
+        atb::VariantPack variant_pack;
+        for (uint32_t i = 0; i < desc.inTensorNum; ++i) {
+            atb::Tensor tensor;
+            tensor.desc = desc.tensorDescs[i];
+            tensor.dataSize = tensorBytes(tensor.desc);
+            variant_pack.inTensors.push_back(tensor);
+        }
+        for (uint32_t i = 0; i < desc.outTensorNum; ++i) {
+            atb::Tensor tensor;
+            tensor.desc = desc.tensorDescs[desc.inTensorNum + i];
+            tensor.dataSize = tensorBytes(tensor.desc);
+            variant_pack.outTensors.push_back(tensor);
         }
+        weights.resize(variant_pack.inTensors.size());
 
-        if (workspace == nullptr && workspaceSize > 0) {
-            int ret = aclrtMalloc(&workspace, workspaceSize, ACL_MEM_MALLOC_HUGE_FIRST);
-            if (ret != 0) {
-                std::cout << "malloc workspace failed, ret: " << ret << std::endl;
+        // node operations keep per-Setup state, so every slot gets its own
+        // graph instead of sharing one across dispatcher threads
+        for (auto& slot : slots) {
+            slot->variant_pack = variant_pack;
+            slot->graph = createGraph(desc);
+
+            atb::Status st = slot->graph->Setup(slot->variant_pack, slot->workspaceSize);
+            if (st == 0) {
+                std::cout << "graph work space size: " << slot->workspaceSize << std::endl;
+            } else {
+                std::cout << "graph setup failed, st: " << st << std::endl;
+            }
+
+            if (slot->workspace == nullptr && slot->workspaceSize > 0) {
+                int ret = aclrtMalloc(&slot->workspace, slot->workspaceSize, ACL_MEM_MALLOC_HUGE_FIRST);
+                if (ret != 0) {
+                    std::cout << "malloc workspace failed, ret: " << ret << std::endl;
+                    slot->workspace = nullptr;
+                    slot->workspaceSize = 0;  // launch allocates it again
+                }
             }
         }
     }
 
-    void run(void* inputs[], int input_size, void* outputs[], int output_size) {
-        for (int i = 0; i < input_size; ++i) {
-            variant_pack.inTensors[i].deviceData = inputs[i];
-            // std::cout << "input ptr: " << inputs[i] << std::endl;
+    const FusionReport& fusionReport() const {
+        return fusion_report;
+    }
+
+    // serve input index from the weight registry instead of the caller's
+    // pointer. Dispatchers read weights without a lock, so binding is only
+    // accepted until the first run starts them.
+    int bindWeight(int index, const std::string& name) {
+        std::lock_guard<std::mutex> lock(start_mutex);
+        if (started.load()) {
+            std::cout << "bind weight " << name << " after the first run" << std::endl;
+            return -1;
+        }
+        if (index < 0 || index >= static_cast<int>(weights.size())) {
+            std::cout << "bind weight " << name << " to invalid input " << index << std::endl;
+            return -1;
         }
-        for (int i = 0; i < output_size; ++i) {
-            variant_pack.outTensors[i].deviceData = outputs[i];
-            // std::cout << "out ptr: " << outputs[i] << std::endl;
+        WeightEntry* entry = WeightRegistry::instance().acquire(name);
+        if (entry == nullptr) {
+            std::cout << "weight " << name << " is not registered" << std::endl;
+            return -1;
         }
-        graph->Setup(variant_pack, workspaceSize);
-        graph->Execute(variant_pack, static_cast<uint8_t*>(workspace), workspaceSize, context);
-        aclrtSynchronizeStream(stream);
+        WeightHandle handle(entry);
+        uint64_t expected = slots[0]->variant_pack.inTensors[index].dataSize;
+        if (handle.size() != expected) {
+            std::cout << "weight " << name << " has " << handle.size() << " bytes, input " << index
+                      << " needs " << expected << std::endl;
+            return -1;
+        }
+        weights[index] = handle;
+        return 0;
+    }
+
+    int run(void* inputs[], int input_size, void* outputs[], int output_size) {
+        // callers stick to one slot for their lifetime, handed out round robin
+        static std::atomic<unsigned int> next_caller{0};
+        static thread_local unsigned int caller_id = next_caller.fetch_add(1);
+        ExecSlot& slot = *slots[caller_id % slots.size()];
+        if (!started.load()) {
+            startDispatchers();
+        }
+
+        RunRequest req;
+        req.inputs = inputs;
+        req.input_size = input_size;
+        req.outputs = outputs;
+        req.output_size = output_size;
+        auto done = req.done.get_future();
+
+        slot.queue.push(&req);
+        // pairs with the fence after parked is set, so either we see parked
+        // or the dispatcher's re-check sees our request
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (slot.parked.load()) {
+            std::lock_guard<std::mutex> lock(slot.park_mutex);
+            slot.park_cv.notify_one();
+        }
+        return done.get();
     }
 
     ~AtbGraph() {
-        if (outter_workspace == nullptr && workspace != nullptr) {
-            aclrtFree(workspace);
-        } 
+        stopping.store(true);
+        for (auto& slot : slots) {
+            {
+                std::lock_guard<std::mutex> lock(slot->park_mutex);
+                slot->park_cv.notify_one();
+            }
+            if (slot->dispatcher.joinable()) {
+                slot->dispatcher.join();
+            }
+        }
 
-        int ret = atb::DestroyContext(context);
-        if (ret != 0) {
-            std::cout << "atb::DestroyContext faield, ret: " << ret << std::endl;
+        for (auto& slot : slots) {
+            if (slot->own_workspace && slot->workspace != nullptr) {
+                aclrtFree(slot->workspace);
+            }
+
+            int ret = atb::DestroyContext(slot->context);
+            if (ret != 0) {
+                std::cout << "atb::DestroyContext faield, ret: " << ret << std::endl;
+            }
+
+            if (slot->own_stream) {
+                ret = aclrtDestroyStream(slot->stream);
+                if (ret != 0) {
+                    std::cout << "aclrtDestroyStream faield, ret: " << ret << std::endl;
+                }
+            }
+
+            atb::Status st = atb::DestroyOperation(slot->graph);
+            if (st != 0) {
+                std::cout << "atb::DestroyOperation faield, st: " << st << std::endl;
+            }
         }
+    }
 
-        ret = aclrtDestroyStream(stream);
-        if (ret != 0) {
-            std::cout << "aclrtDestroyStream faield, ret: " << ret << std::endl;
+  private:
+    // deferred to the first run so weights can be bound without racing them
+    void startDispatchers() {
+        std::lock_guard<std::mutex> lock(start_mutex);
+        if (started.load()) {
+            return;
+        }
+        for (auto& slot : slots) {
+            ExecSlot* s = slot.get();
+            s->dispatcher = std::thread([this, s]() { dispatch(*s); });
+        }
+        started.store(true);
+    }
+
+    int execute(ExecSlot& slot, const RunRequest& req) {
+        for (int i = 0; i < req.input_size; ++i) {
+            slot.variant_pack.inTensors[i].deviceData = req.inputs[i];
+        }
+        for (int i = 0; i < req.output_size; ++i) {
+            slot.variant_pack.outTensors[i].deviceData = req.outputs[i];
+        }
+        // pinned weights stay resident until the stream has drained
+        int pinned = 0;
+        int st = 0;
+        for (; pinned < static_cast<int>(weights.size()); ++pinned) {
+            if (!weights[pinned]) {
+                continue;
+            }
+            void* device = weights[pinned].pin();
+            if (device == nullptr) {
+                st = -1;
+                break;
+            }
+            slot.variant_pack.inTensors[pinned].deviceData = device;
+        }
+        if (st == 0) {
+            st = launch(slot);
+        }
+        for (int i = 0; i < pinned; ++i) {
+            if (weights[i]) {
+                weights[i].unpin();
+            }
+        }
+        return st;
+    }
+
+    int launch(ExecSlot& slot) {
+        uint64_t workspaceSize = 0;
+        atb::Status st = slot.graph->Setup(slot.variant_pack, workspaceSize);
+        if (st != 0) {
+            std::cout << "graph setup failed, st: " << st << std::endl;
+            return st;
+        }
+        if (workspaceSize > slot.workspaceSize) {
+            if (!slot.own_workspace) {
+                std::cout << "outter workspace too small, need: " << workspaceSize << std::endl;
+                return -1;
+            }
+            if (slot.workspace != nullptr) {
+                aclrtFree(slot.workspace);
+            }
+            int ret = aclrtMalloc(&slot.workspace, workspaceSize, ACL_MEM_MALLOC_HUGE_FIRST);
+            if (ret != 0) {
+                std::cout << "malloc workspace failed, ret: " << ret << std::endl;
+                slot.workspace = nullptr;
+                slot.workspaceSize = 0;
+                return ret;
+            }
+            slot.workspaceSize = workspaceSize;
         }
 
-        atb::Status st = atb::DestroyOperation(graph);
+        st = slot.graph->Execute(slot.variant_pack, static_cast<uint8_t*>(slot.workspace), workspaceSize, slot.context);
         if (st != 0) {
-            std::cout << "atb::DestroyOperation faield, st: " << st << std::endl;
+            std::cout << "graph execute failed, st: " << st << std::endl;
+            return st;
         }
+        return aclrtSynchronizeStream(slot.stream);
     }
 
-  private:
-    void *outter_workspace;
-    void *stream;
-    atb::VariantPack variant_pack;
-    atb::Operation *graph;
-    uint64_t workspaceSize;
-    atb::Context *context;
-    void *workspace;
+    void dispatch(ExecSlot& slot) {
+        int ret = aclrtSetCurrentContext(device_context);
+        if (ret != 0) {
+            std::cout << "aclrtSetCurrentContext faield, ret: " << ret << std::endl;
+        }
+
+        const int spin_rounds = 64;
+        int idle = 0;
+        while (true) {
+            RunRequest* req = slot.queue.pop();
+            if (req != nullptr) {
+                idle = 0;
+                // req belongs to the caller again once done is set
+                req->done.set_value(execute(slot, *req));
+                continue;
+            }
+            if (stopping.load()) {
+                break;
+            }
+            if (++idle < spin_rounds) {
+                std::this_thread::yield();
+                continue;
+            }
+
+            // park until a producer sees parked and notifies, the queue is
+            // re-checked under the lock each time we wake
+            std::unique_lock<std::mutex> lock(slot.park_mutex);
+            slot.parked.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            slot.park_cv.wait(lock, [&]() {
+                req = slot.queue.pop();
+                return req != nullptr || stopping.load();
+            });
+            slot.parked.store(false);
+            lock.unlock();
+            if (req != nullptr) {
+                idle = 0;
+                req->done.set_value(execute(slot, *req));
+            }
+        }
+    }
+
+    bool with_bias;
+    aclrtContext device_context = nullptr;
+    std::vector<std::unique_ptr<ExecSlot>> slots;
+    FusionReport fusion_report;
+    std::vector<WeightHandle> weights;  // per input index, empty when caller provided
+    std::mutex start_mutex;
+    std::atomic<bool> started{false};
+    std::atomic<bool> stopping{false};
 };
 
 AtbGraph* graph = nullptr;
@@ -201,6 +1087,44 @@ extern "C" void init(void* workspace, void* stream) {
     graph = new AtbGraph(workspace, stream);
 }
 
-extern "C" void run(void* inputs[], int input_size, void* outputs[], int output_size) {
-    graph->run(inputs, input_size, outputs, output_size);
+// num_streams dispatchers, each with its own stream, context and variant pack;
+// caller threads are spread across them round robin
+extern "C" void init_pool(void* workspace, void* stream, int num_streams) {
+    graph = new AtbGraph(workspace, stream, num_streams);
+}
+
+// a1 @ b1 + bias + a2 @ b2, bias is input 4; exercises the epilogue fusion
+extern "C" void init_bias(void* workspace, void* stream) {
+    graph = new AtbGraph(workspace, stream, 1, true);
+}
+
+extern "C" int run(void* inputs[], int input_size, void* outputs[], int output_size) {
+    return graph->run(inputs, input_size, outputs, output_size);
+}
+
+// lazy weights are copied to host now and uploaded on first use
+extern "C" int register_weight(const char* name, void* host_data, uint64_t size, int lazy) {
+    return WeightRegistry::instance().add(name, host_data, size, lazy != 0);
+}
+
+extern "C" int unregister_weight(const char* name) {
+    return WeightRegistry::instance().remove(name);
+}
+
+extern "C" void set_weight_budget(uint64_t bytes) {
+    WeightRegistry::instance().setBudget(bytes);
+}
+
+extern "C" int bind_weight(int input_index, const char* name) {
+    return graph->bindWeight(input_index, name);
+}
+
+extern "C" void fusion_stats(int* launches_saved, uint64_t* bytes_saved) {
+    *launches_saved = graph->fusionReport().launchesSaved;
+    *bytes_saved = graph->fusionReport().bytesSaved;
+}
+
+extern "C" void release() {
+    delete graph;
+    graph = nullptr;
 }
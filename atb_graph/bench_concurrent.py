@@ -0,0 +1,60 @@
+import torch
+import torch_dipu
+
+import acl
+
+import ctypes
+import threading
+import time
+
+iters = 200
+
+graph = ctypes.CDLL('atb_graph.so')
+graph.run.restype = ctypes.c_int
+
+
+def worker(device, barrier, errors, ends):
+    # ctypes drops the GIL around graph.run, so threads really overlap
+    torch.cuda.set_device(device)
+    a1 = torch.randn(1, 4096, dtype=torch.float16, device='cuda')
+    b1 = torch.randn(4096, 4096, dtype=torch.float16, device='cuda')
+    a2 = torch.randn(1, 4096, dtype=torch.float16, device='cuda')
+    b2 = torch.randn(4096, 4096, dtype=torch.float16, device='cuda')
+    out = torch.empty(1, 4096, dtype=torch.float16, device='cuda')
+
+    inputs = [a1, b1, a2, b2]
+    ctype_inputs = (ctypes.c_void_p * len(inputs))(*[x.data_ptr() for x in inputs])
+    outputs = [out]
+    ctype_outputs = (ctypes.c_void_p * len(outputs))(*[x.data_ptr() for x in outputs])
+
+    barrier.wait()
+    for _ in range(iters):
+        ret = graph.run(ctype_inputs, len(inputs), ctype_outputs, len(outputs))
+        if ret != 0:
+            errors.append(ret)
+            break
+    ends.append(time.time())
+
+    ref = torch.mm(a1.to(torch.float), b1.to(torch.float)) + torch.mm(a2.to(torch.float), b2.to(torch.float))
+    if not torch.allclose(out.to(torch.float), ref, rtol=1e-2, atol=1e-1):
+        errors.append('mismatch')
+
+
+device = torch.cuda.current_device()
+for num_threads in [1, 2, 4, 8]:
+    graph.init_pool(ctypes.c_void_p(None), ctypes.c_void_p(None), num_threads)
+
+    barrier = threading.Barrier(num_threads + 1)
+    errors = []
+    ends = []
+    threads = [threading.Thread(target=worker, args=(device, barrier, errors, ends)) for _ in range(num_threads)]
+    for t in threads:
+        t.start()
+    barrier.wait()
+    start = time.time()
+    for t in threads:
+        t.join()
+    cost = max(ends) - start
+
+    graph.release()
+    print('threads: %d, runs/s: %.1f, errors: %s' % (num_threads, num_threads * iters / cost, errors))
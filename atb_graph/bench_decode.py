@@ -0,0 +1,112 @@
+import torch
+import torch_dipu
+
+import acl
+
+import ctypes
+import math
+import time
+
+head_num = 32
+kv_head_num = 32
+head_dim = 128
+block_size = 128
+steps = 64
+warmup = 4
+
+graph = ctypes.CDLL('decode_graph.so')
+graph.decode_step.restype = ctypes.c_int
+graph.decode_reserve.restype = ctypes.c_int
+graph.decode_free_blocks.restype = ctypes.c_int
+
+stream, ret = acl.rt.create_stream()
+
+
+def step(seq_ids, q, k, v, out):
+    ids = (ctypes.c_int64 * len(seq_ids))(*seq_ids)
+    args = [ctypes.c_void_p(x.data_ptr()) for x in [q, k, v, out]]
+    return graph.decode_step(ids, len(seq_ids), *args)
+
+
+def reference(q, keys, values):
+    # q: head_num, head_dim   keys, values: tokens, kv_head_num, head_dim
+    group = head_num // kv_head_num
+    keys = keys.to(torch.float).repeat_interleave(group, dim=1)
+    values = values.to(torch.float).repeat_interleave(group, dim=1)
+    scores = torch.einsum('hd,thd->ht', q.to(torch.float), keys) / math.sqrt(head_dim)
+    return torch.einsum('ht,thd->hd', torch.softmax(scores, dim=-1), values)
+
+
+# correctness: two sequences decode token by token across block boundaries,
+# then the first is freed and a new request has to reuse its blocks
+check_block_size = 16
+check_tokens = 2 * check_block_size + 3
+blocks_per_seq = (check_tokens + check_block_size - 1) // check_block_size
+graph.decode_init(ctypes.c_void_p(stream), 2 * blocks_per_seq, check_block_size, head_num, kv_head_num,
+                  head_dim, check_tokens)
+
+
+def decode_and_check(seq_ids):
+    history = {i: ([], []) for i in seq_ids}
+    for t in range(check_tokens):
+        batch = len(seq_ids)
+        q = torch.randn(batch, head_num, head_dim, dtype=torch.float16, device='cuda')
+        k = torch.randn(batch, kv_head_num, head_dim, dtype=torch.float16, device='cuda')
+        v = torch.randn(batch, kv_head_num, head_dim, dtype=torch.float16, device='cuda')
+        out = torch.empty(batch, head_num, head_dim, dtype=torch.float16, device='cuda')
+        assert step(seq_ids, q, k, v, out) == 0, 'decode step %d failed' % t
+        for b, i in enumerate(seq_ids):
+            history[i][0].append(k[b])
+            history[i][1].append(v[b])
+            ref = reference(q[b], torch.stack(history[i][0]), torch.stack(history[i][1]))
+            assert torch.allclose(out[b].to(torch.float), ref, rtol=1e-2, atol=1e-2), \
+                'sequence %d token %d mismatch' % (i, t)
+
+
+graph.decode_add_sequence(ctypes.c_int64(0))
+graph.decode_add_sequence(ctypes.c_int64(1))
+decode_and_check([0, 1])
+assert graph.decode_free_blocks() == 0
+assert graph.decode_free_sequence(ctypes.c_int64(0)) == 0
+assert graph.decode_free_blocks() == blocks_per_seq
+graph.decode_add_sequence(ctypes.c_int64(2))
+decode_and_check([2])
+graph.decode_release()
+print('paged decode matches pytorch')
+
+print('batch, seq_len, tokens/s')
+for batch in [1, 4, 16, 32]:
+    for seq_len in [128, 512, 1024, 2048]:
+        max_seq_len = seq_len + warmup + steps
+        blocks_per_seq = (max_seq_len + block_size - 1) // block_size
+        graph.decode_init(ctypes.c_void_p(stream), batch * blocks_per_seq, block_size, head_num, kv_head_num,
+                          head_dim, max_seq_len)
+
+        # the prompt is assumed to be in the cache already, only its blocks are taken
+        seq_ids = list(range(batch))
+        for i in seq_ids:
+            graph.decode_add_sequence(ctypes.c_int64(i))
+            graph.decode_reserve(ctypes.c_int64(i), seq_len)
+
+        q = torch.randn(batch, head_num, head_dim, dtype=torch.float16, device='cuda')
+        k = torch.randn(batch, kv_head_num, head_dim, dtype=torch.float16, device='cuda')
+        v = torch.randn(batch, kv_head_num, head_dim, dtype=torch.float16, device='cuda')
+        out = torch.empty(batch, head_num, head_dim, dtype=torch.float16, device='cuda')
+
+        for _ in range(warmup):
+            step(seq_ids, q, k, v, out)
+        start = time.time()
+        for _ in range(steps):
+            ret = step(seq_ids, q, k, v, out)
+            if ret != 0:
+                print('decode step failed, ret:', ret)
+                break
+        cost = time.time() - start
+
+        for i in seq_ids:
+            graph.decode_free_sequence(ctypes.c_int64(i))
+        assert graph.decode_free_blocks() == batch * blocks_per_seq
+        graph.decode_release()
+        print('%d, %d, %.1f' % (batch, seq_len, batch * steps / cost))
+
+acl.rt.destroy_stream(stream)
@@ -0,0 +1,473 @@
+#include <cmath>
+#include <iostream>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "acl/acl.h"
+#include "atb/atb_infer.h"
+
+atb::Tensor genTensor(const std::vector<int64_t>& dims, aclDataType dtype, aclFormat format, void* host_data, void* device_data) {
+    atb::Dims atb_dims;
+    atb::TensorDesc desc;
+    atb::Tensor tensor;
+
+    // init atb dims
+    auto dim_num = dims.size();
+    atb_dims.dimNum = static_cast<uint64_t>(dim_num);
+    int64_t nums = 1;
+    for (unsigned int i = 0; i < dim_num; ++i) {
+        atb_dims.dims[i] = dims[i];
+        nums *= dims[i];
+    }
+    int64_t data_size = nums * aclDataTypeSize(dtype);
+
+    // init atb tensor desc
+    desc.dtype = dtype;
+    desc.format = format;
+    desc.shape = atb_dims;
+
+    // init tensor
+    tensor.desc = desc;
+    tensor.hostData = host_data;
+    tensor.deviceData = device_data;
+    tensor.dataSize = static_cast<uint64_t>(data_size);
+    return tensor;
+}
+
+// hands out fixed-size cache blocks from one preallocated pool
+class BlockAllocator {
+  public:
+    explicit BlockAllocator(int num_blocks) {
+        for (int i = num_blocks - 1; i >= 0; --i) {
+            free_blocks.push_back(i);
+        }
+    }
+
+    int allocate() {
+        if (free_blocks.empty()) {
+            return -1;
+        }
+        int block = free_blocks.back();
+        free_blocks.pop_back();
+        return block;
+    }
+
+    void free(int block) {
+        free_blocks.push_back(block);
+    }
+
+    int available() const {
+        return static_cast<int>(free_blocks.size());
+    }
+
+  private:
+    std::vector<int> free_blocks;
+};
+
+struct Sequence {
+    std::vector<int32_t> blocks;  // block table, logical block i -> cache block
+    int32_t len = 0;              // tokens already in the cache
+};
+
+// Graph and bound buffers for one batch size. Block tables are padded to
+// max_blocks_per_seq, so batch is the only thing that changes the shapes
+// and a bucket's graph and bindings are built once.
+struct DecodeBucket {
+    atb::Operation *graph = nullptr;
+    atb::VariantPack variant_pack;
+    void *workspace = nullptr;
+    uint64_t workspaceSize = 0;
+
+    // block tables | context lens | slot mapping, one H2D copy per step;
+    // the host side is page-locked so the copy can be async
+    int32_t *host_meta = nullptr;
+    uint64_t meta_size = 0;
+    void *meta = nullptr;
+};
+
+class AtbDecodeGraph {
+  public:
+    AtbDecodeGraph(void* outter_stream, int _num_blocks, int _block_size, int _head_num, int _kv_head_num,
+                   int _head_dim, int max_seq_len)
+        : stream(outter_stream), num_blocks(_num_blocks), block_size(_block_size), head_num(_head_num),
+          kv_head_num(_kv_head_num), head_dim(_head_dim), allocator(_num_blocks) {
+        max_blocks_per_seq = (max_seq_len + block_size - 1) / block_size;
+
+        int ret = atb::CreateContext(&context);
+        if (ret != 0) {
+            std::cout << "atb::CreateContext faield, ret: " << ret << std::endl;
+        }
+        if (stream == nullptr) {
+            ret = aclrtCreateStream(&stream);
+            if (ret != 0) {
+                std::cout << "aclrtCreateStream faield, ret: " << ret << std::endl;
+            }
+            own_stream = true;
+        }
+        context->SetExecuteStream(stream);
+
+        // key/value cache: num_blocks, block_size, kv_head_num, head_dim
+        std::vector<int64_t> cache_shape {num_blocks, block_size, kv_head_num, head_dim};
+        key_cache = genTensor(cache_shape, ACL_FLOAT16, ACL_FORMAT_ND, nullptr, nullptr);
+        value_cache = genTensor(cache_shape, ACL_FLOAT16, ACL_FORMAT_ND, nullptr, nullptr);
+        ret = aclrtMalloc(&key_cache.deviceData, key_cache.dataSize, ACL_MEM_MALLOC_HUGE_FIRST);
+        if (ret != 0) {
+            std::cout << "malloc key cache failed, ret: " << ret << std::endl;
+        }
+        ret = aclrtMalloc(&value_cache.deviceData, value_cache.dataSize, ACL_MEM_MALLOC_HUGE_FIRST);
+        if (ret != 0) {
+            std::cout << "malloc value cache failed, ret: " << ret << std::endl;
+        }
+    }
+
+    int addSequence(int64_t seq_id) {
+        if (sequences.count(seq_id) != 0) {
+            std::cout << "sequence " << seq_id << " already exists" << std::endl;
+            return -1;
+        }
+        sequences[seq_id] = Sequence();
+        return 0;
+    }
+
+    int freeSequence(int64_t seq_id) {
+        auto it = sequences.find(seq_id);
+        if (it == sequences.end()) {
+            return -1;
+        }
+        for (auto block : it->second.blocks) {
+            allocator.free(block);
+        }
+        sequences.erase(it);
+        return 0;
+    }
+
+    // account for tokens written by a prefill outside this graph
+    int reserve(int64_t seq_id, int tokens) {
+        if (tokens < 0) {
+            std::cout << "reserve " << tokens << " tokens is negative" << std::endl;
+            return -1;
+        }
+        auto it = sequences.find(seq_id);
+        if (it == sequences.end()) {
+            return -1;
+        }
+        Sequence& seq = it->second;
+        int64_t needed = (static_cast<int64_t>(seq.len) + tokens + block_size - 1) / block_size;
+        if (needed > max_blocks_per_seq || needed - static_cast<int64_t>(seq.blocks.size()) > allocator.available()) {
+            std::cout << "reserve " << tokens << " tokens for sequence " << seq_id << " failed" << std::endl;
+            return -1;
+        }
+        while (static_cast<int>(seq.blocks.size()) < needed) {
+            seq.blocks.push_back(allocator.allocate());
+        }
+        seq.len += tokens;
+        return 0;
+    }
+
+    int freeBlocks() const {
+        return allocator.available();
+    }
+
+    // q: batch, head_num, head_dim   k, v: batch, kv_head_num, head_dim
+    int step(const int64_t* seq_ids, int batch, void* q, void* k, void* v, void* out) {
+        if (seq_ids == nullptr || batch < 1) {
+            std::cout << "decode step needs at least one sequence, batch: " << batch << std::endl;
+            return -1;
+        }
+        // check everything first; sequences only grow once Execute succeeded
+        std::unordered_set<int64_t> seen;
+        int new_blocks = 0;
+        for (int b = 0; b < batch; ++b) {
+            if (!seen.insert(seq_ids[b]).second) {
+                std::cout << "sequence " << seq_ids[b] << " appears twice in one step" << std::endl;
+                return -1;
+            }
+            auto it = sequences.find(seq_ids[b]);
+            if (it == sequences.end()) {
+                std::cout << "unknown sequence " << seq_ids[b] << std::endl;
+                return -1;
+            }
+            const Sequence& seq = it->second;
+            if (seq.len % block_size == 0) {
+                if (seq.len / block_size >= max_blocks_per_seq) {
+                    std::cout << "sequence " << seq_ids[b] << " reached max length" << std::endl;
+                    return -1;
+                }
+                ++new_blocks;
+            }
+        }
+        if (new_blocks > allocator.available()) {
+            std::cout << "kv cache out of blocks, need: " << new_blocks << std::endl;
+            return -1;
+        }
+
+        DecodeBucket& bucket = getBucket(batch);
+        int32_t* block_tables = bucket.host_meta;
+        int32_t* context_lens = block_tables + batch * max_blocks_per_seq;
+        int32_t* slot_mapping = context_lens + batch;
+        step_blocks.assign(batch, -1);
+        for (int b = 0; b < batch; ++b) {
+            const Sequence& seq = sequences[seq_ids[b]];
+            int32_t* row = block_tables + b * max_blocks_per_seq;
+            int used = static_cast<int>(seq.blocks.size());
+            for (int i = 0; i < used; ++i) {
+                row[i] = seq.blocks[i];
+            }
+            if (seq.len % block_size == 0) {
+                step_blocks[b] = allocator.allocate();
+                row[used++] = step_blocks[b];
+            }
+            // padding entries are never read past context_lens
+            for (int i = used; i < max_blocks_per_seq; ++i) {
+                row[i] = 0;
+            }
+            slot_mapping[b] = row[seq.len / block_size] * block_size + seq.len % block_size;
+            context_lens[b] = seq.len + 1;
+        }
+
+        int ret = execute(bucket, q, k, v, out);
+        for (int b = 0; b < batch; ++b) {
+            if (ret != 0) {
+                if (step_blocks[b] >= 0) {
+                    allocator.free(step_blocks[b]);
+                }
+                continue;
+            }
+            Sequence& seq = sequences[seq_ids[b]];
+            if (step_blocks[b] >= 0) {
+                seq.blocks.push_back(step_blocks[b]);
+            }
+            ++seq.len;
+        }
+        return ret;
+    }
+
+    ~AtbDecodeGraph() {
+        for (auto& item : buckets) {
+            DecodeBucket& bucket = item.second;
+            if (bucket.workspace != nullptr) {
+                aclrtFree(bucket.workspace);
+            }
+            aclrtFree(bucket.meta);
+            aclrtFreeHost(bucket.host_meta);
+            atb::Status st = atb::DestroyOperation(bucket.graph);
+            if (st != 0) {
+                std::cout << "atb::DestroyOperation faield, st: " << st << std::endl;
+            }
+        }
+        aclrtFree(key_cache.deviceData);
+        aclrtFree(value_cache.deviceData);
+
+        int ret = atb::DestroyContext(context);
+        if (ret != 0) {
+            std::cout << "atb::DestroyContext faield, ret: " << ret << std::endl;
+        }
+        if (own_stream) {
+            ret = aclrtDestroyStream(stream);
+            if (ret != 0) {
+                std::cout << "aclrtDestroyStream faield, ret: " << ret << std::endl;
+            }
+        }
+    }
+
+  private:
+    int execute(DecodeBucket& bucket, void* q, void* k, void* v, void* out) {
+        // only the per-token activations are rebound, cache and meta pointers
+        // were bound when the bucket was built
+        bucket.variant_pack.inTensors[0].deviceData = q;
+        bucket.variant_pack.inTensors[1].deviceData = k;
+        bucket.variant_pack.inTensors[2].deviceData = v;
+        bucket.variant_pack.outTensors[0].deviceData = out;
+
+        // Setup runs every token: atb fills paged attention's host tiling from
+        // context lens inside Setup (graph_runner "fill all node host tiling
+        // buffer" in atb_graph/log) and Execute only copies it to the device
+        uint64_t workspaceSize = 0;
+        atb::Status st = bucket.graph->Setup(bucket.variant_pack, workspaceSize);
+        if (st != 0) {
+            std::cout << "decode graph setup failed, st: " << st << std::endl;
+            return st;
+        }
+        if (workspaceSize > bucket.workspaceSize) {
+            if (bucket.workspace != nullptr) {
+                aclrtFree(bucket.workspace);
+            }
+            bucket.workspace = nullptr;
+            bucket.workspaceSize = 0;
+            int ret = aclrtMalloc(&bucket.workspace, workspaceSize, ACL_MEM_MALLOC_HUGE_FIRST);
+            if (ret != 0) {
+                std::cout << "malloc workspace failed, ret: " << ret << std::endl;
+                bucket.workspace = nullptr;
+                return ret;
+            }
+            bucket.workspaceSize = workspaceSize;
+        }
+
+        int ret = aclrtMemcpyAsync(bucket.meta, bucket.meta_size, bucket.host_meta, bucket.meta_size,
+                                   ACL_MEMCPY_HOST_TO_DEVICE, stream);
+        if (ret != 0) {
+            std::cout << "meta aclrtMemcpyAsync failed, ret: " << ret << std::endl;
+            return ret;
+        }
+        st = bucket.graph->Execute(bucket.variant_pack, static_cast<uint8_t*>(bucket.workspace),
+                                   workspaceSize, context);
+        if (st != 0) {
+            std::cout << "decode graph execute failed, st: " << st << std::endl;
+            return st;
+        }
+        return aclrtSynchronizeStream(stream);
+    }
+
+    atb::Operation* createGraph() {
+        // q  k  v  key_cache  value_cache  slot_mapping  block_tables  context_lens
+        //    \  |      |          |          /                |            |
+        //     reshape_and_cache: writes k, v into the cache in place      |
+        //                          |          |                           |
+        // q ------------------- paged_attention ---------------------------
+        //                             |
+        //                      out: batch, head_num, head_dim
+
+        atb::infer::ReshapeAndCacheParam cache_param;
+        atb::Operation *cache_op = nullptr;
+        atb::Status st = atb::CreateOperation(cache_param, &cache_op);
+        if (st != 0) {
+            std::cout << "atb CreateOperation reshape_and_cache failed, st: " << st << std::endl;
+        }
+
+        atb::infer::PagedAttentionParam pa_param;
+        pa_param.headNum = head_num;
+        pa_param.kvHeadNum = kv_head_num;
+        pa_param.qkScale = 1.0f / std::sqrt(static_cast<float>(head_dim));
+        atb::Operation *pa_op = nullptr;
+        st = atb::CreateOperation(pa_param, &pa_op);
+        if (st != 0) {
+            std::cout << "atb CreateOperation paged_attention failed, st: " << st << std::endl;
+        }
+
+        // graph
+        atb::GraphParam graph_param;
+        graph_param.inTensorNum = 8;
+        graph_param.outTensorNum = 1;
+        graph_param.internalTensorNum = 0;
+        graph_param.nodes.resize(2);
+
+        graph_param.nodes[0].operation = cache_op;
+        graph_param.nodes[0].inTensorIds = {1, 2, 3, 4, 7};
+        graph_param.nodes[0].outTensorIds = {3, 4};
+        graph_param.nodes[1].operation = pa_op;
+        graph_param.nodes[1].inTensorIds = {0, 3, 4, 5, 6};
+        graph_param.nodes[1].outTensorIds = {8};
+
+        atb::Operation *graph_op = nullptr;
+        st = atb::CreateOperation(graph_param, &graph_op);
+        if (st != 0) {
+            std::cout << "atb CreateOperation decode graph failed, st: " << st << std::endl;
+        }
+        return graph_op;
+    }
+
+    DecodeBucket& getBucket(int batch) {
+        auto it = buckets.find(batch);
+        if (it != buckets.end()) {
+            return it->second;
+        }
+        DecodeBucket& bucket = buckets[batch];
+
+        bucket.meta_size = (batch * max_blocks_per_seq + batch + batch) * sizeof(int32_t);
+        void* host_meta = nullptr;
+        int ret = aclrtMallocHost(&host_meta, bucket.meta_size);
+        if (ret != 0) {
+            std::cout << "malloc host decode meta failed, ret: " << ret << std::endl;
+        }
+        bucket.host_meta = static_cast<int32_t*>(host_meta);
+        ret = aclrtMalloc(&bucket.meta, bucket.meta_size, ACL_MEM_MALLOC_HUGE_FIRST);
+        if (ret != 0) {
+            std::cout << "malloc decode meta failed, ret: " << ret << std::endl;
+        }
+        int32_t* host_block_tables = bucket.host_meta;
+        int32_t* host_context_lens = host_block_tables + batch * max_blocks_per_seq;
+        int32_t* host_slot_mapping = host_context_lens + batch;
+        int32_t* device_block_tables = static_cast<int32_t*>(bucket.meta);
+        int32_t* device_context_lens = device_block_tables + batch * max_blocks_per_seq;
+        int32_t* device_slot_mapping = device_context_lens + batch;
+
+        std::vector<int64_t> q_shape {batch, head_num, head_dim};
+        std::vector<int64_t> kv_shape {batch, kv_head_num, head_dim};
+        std::vector<int64_t> block_tables_shape {batch, max_blocks_per_seq};
+        std::vector<int64_t> batch_shape {batch};
+        auto q = genTensor(q_shape, ACL_FLOAT16, ACL_FORMAT_ND, nullptr, nullptr);
+        auto k = genTensor(kv_shape, ACL_FLOAT16, ACL_FORMAT_ND, nullptr, nullptr);
+        auto v = genTensor(kv_shape, ACL_FLOAT16, ACL_FORMAT_ND, nullptr, nullptr);
+        auto block_tables = genTensor(block_tables_shape, ACL_INT32, ACL_FORMAT_ND, host_block_tables, device_block_tables);
+        // paged attention reads context lens on host, the mirror is refreshed in place every step
+        auto context_lens = genTensor(batch_shape, ACL_INT32, ACL_FORMAT_ND, host_context_lens, device_context_lens);
+        auto slot_mapping = genTensor(batch_shape, ACL_INT32, ACL_FORMAT_ND, host_slot_mapping, device_slot_mapping);
+        auto out = genTensor(q_shape, ACL_FLOAT16, ACL_FORMAT_ND, nullptr, nullptr);
+
+        bucket.variant_pack.inTensors.push_back(q);             // 0
+        bucket.variant_pack.inTensors.push_back(k);             // 1
+        bucket.variant_pack.inTensors.push_back(v);             // 2
+        bucket.variant_pack.inTensors.push_back(key_cache);     // 3
+        bucket.variant_pack.inTensors.push_back(value_cache);   // 4
+        bucket.variant_pack.inTensors.push_back(block_tables);  // 5
+        bucket.variant_pack.inTensors.push_back(context_lens);  // 6
+        bucket.variant_pack.inTensors.push_back(slot_mapping);  // 7
+        bucket.variant_pack.outTensors.push_back(out);          // 8
+
+        bucket.graph = createGraph();
+        return bucket;
+    }
+
+    void *stream;
+    bool own_stream = false;
+    atb::Context *context = nullptr;
+
+    int num_blocks;
+    int block_size;
+    int head_num;
+    int kv_head_num;
+    int head_dim;
+    int max_blocks_per_seq;
+
+    atb::Tensor key_cache;
+    atb::Tensor value_cache;
+    BlockAllocator allocator;
+    std::vector<int32_t> step_blocks;  // block newly taken per batch entry this step, -1 if none
+    std::unordered_map<int64_t, Sequence> sequences;
+    std::map<int, DecodeBucket> buckets;
+};
+
+AtbDecodeGraph* decode_graph = nullptr;
+
+extern "C" void decode_init(void* stream, int num_blocks, int block_size, int head_num, int kv_head_num,
+                            int head_dim, int max_seq_len) {
+    decode_graph = new AtbDecodeGraph(stream, num_blocks, block_size, head_num, kv_head_num, head_dim,
+                                      max_seq_len);
+}
+
+extern "C" int decode_add_sequence(int64_t seq_id) {
+    return decode_graph->addSequence(seq_id);
+}
+
+extern "C" int decode_free_sequence(int64_t seq_id) {
+    return decode_graph->freeSequence(seq_id);
+}
+
+extern "C" int decode_reserve(int64_t seq_id, int tokens) {
+    return decode_graph->reserve(seq_id, tokens);
+}
+
+extern "C" int decode_free_blocks() {
+    return decode_graph->freeBlocks();
+}
+
+extern "C" int decode_step(int64_t* seq_ids, int batch, void* q, void* k, void* v, void* out) {
+    return decode_graph->step(seq_ids, batch, q, k, v, out);
+}
+
+extern "C" void decode_release() {
+    delete decode_graph;
+    decode_graph = nullptr;
+}
@@ -73,6 +73,35 @@ add = mm1 + mm2
 print('pytorch out:')
 print(add)
 
+print()
+print('#########################')
+print('bias graph, mm1 + bias fused into a linear')
+
+bias = torch.randn(4096, dtype=torch.float16, device='cuda')
+out3 = torch.empty(1, 4096, dtype=torch.float16, device='cuda')
+
+graph.release()
+graph.init_bias(ctypes.c_void_p(None), ctypes.c_void_p(stream))
+
+launches_saved = ctypes.c_int(0)
+bytes_saved = ctypes.c_uint64(0)
+graph.fusion_stats(ctypes.byref(launches_saved), ctypes.byref(bytes_saved))
+print('fusion launches saved:', launches_saved.value, 'bytes saved:', bytes_saved.value)
+assert launches_saved.value == 1
+assert bytes_saved.value == 2 * 1 * 4096 * 2
+
+inputs3 = [a1, b1, a2, b2, bias]
+ctype_inputs3 = (ctypes.c_void_p * len(inputs3))(*[x.data_ptr() for x in inputs3])
+ctype_outputs3 = (ctypes.c_void_p * 1)(out3.data_ptr())
+graph.run(ctype_inputs3, len(inputs3), ctype_outputs3, 1)
+
+bias_ref = add + bias.to(torch.float)
+print('after compute!!')
+print(out3)
+print('pytorch out:')
+print(bias_ref)
+assert torch.allclose(out3.to(torch.float), bias_ref, rtol=1e-2, atol=1e-1)
+
 print()
 print()
 print('#########################')
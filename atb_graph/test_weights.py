@@ -0,0 +1,76 @@
+import torch
+import torch_dipu
+
+import acl
+
+import ctypes
+
+a1 = torch.randn(1, 4096, dtype=torch.float16, device='cuda')
+a2 = torch.randn(1, 4096, dtype=torch.float16, device='cuda')
+out = torch.empty(1, 4096, dtype=torch.float16, device='cuda')
+
+# weights live in the registry, uploaded from host
+b1 = torch.randn(4096, 4096, dtype=torch.float16)
+b2 = torch.randn(4096, 4096, dtype=torch.float16)
+b1_copy = b1.clone()
+small = torch.randn(16, dtype=torch.float16)
+weight_bytes = b1.numel() * b1.element_size()
+
+graph = ctypes.CDLL('atb_graph.so')
+graph.run.restype = ctypes.c_int
+graph.register_weight.argtypes = [ctypes.c_char_p, ctypes.c_void_p, ctypes.c_uint64, ctypes.c_int]
+graph.register_weight.restype = ctypes.c_int
+graph.unregister_weight.argtypes = [ctypes.c_char_p]
+graph.unregister_weight.restype = ctypes.c_int
+graph.set_weight_budget.argtypes = [ctypes.c_uint64]
+graph.bind_weight.argtypes = [ctypes.c_int, ctypes.c_char_p]
+graph.bind_weight.restype = ctypes.c_int
+
+
+def register(name, tensor, lazy):
+    return graph.register_weight(name, tensor.data_ptr(), tensor.numel() * tensor.element_size(), lazy)
+
+
+stream, ret = acl.rt.create_stream()
+graph.init(ctypes.c_void_p(None), ctypes.c_void_p(stream))
+
+# b1 is uploaded now, b1_copy has the same bytes and must share its upload
+assert register(b'b1', b1, 0) == 0
+assert register(b'b1_copy', b1_copy, 1) == 0
+assert register(b'b2', b2, 1) == 0
+assert register(b'small', small, 0) == 0
+# same name with other bytes is refused
+assert register(b'b1', b2, 0) != 0
+
+assert graph.bind_weight(1, b'small') != 0  # wrong size for input 1
+assert graph.bind_weight(1, b'b1_copy') == 0
+assert graph.bind_weight(3, b'b2') == 0
+
+# room for one weight only: every run overshoots while both are pinned,
+# then offloads the least recently used one again
+graph.set_weight_budget(weight_bytes)
+
+inputs = [a1.data_ptr(), None, a2.data_ptr(), None]
+ctype_inputs = (ctypes.c_void_p * len(inputs))(*inputs)
+outputs = [out.data_ptr()]
+ctype_outputs = (ctypes.c_void_p * len(outputs))(*outputs)
+
+ref = torch.mm(a1.cpu().to(torch.float), b1.to(torch.float)) + torch.mm(a2.cpu().to(torch.float), b2.to(torch.float))
+for i in range(4):
+    assert graph.run(ctype_inputs, len(inputs), ctype_outputs, len(outputs)) == 0
+    assert torch.allclose(out.cpu().to(torch.float), ref, rtol=1e-2, atol=1e-1), 'run %d mismatch' % i
+print('registry weights match pytorch')
+
+# bindings are fixed once dispatchers run
+assert graph.bind_weight(1, b'b1') != 0
+
+# the graph's handles keep the weights alive after their names are gone
+for name in [b'b1', b'b1_copy', b'b2', b'small']:
+    assert graph.unregister_weight(name) == 0
+assert graph.run(ctype_inputs, len(inputs), ctype_outputs, len(outputs)) == 0
+assert torch.allclose(out.cpu().to(torch.float), ref, rtol=1e-2, atol=1e-1)
+
+graph.release()
+graph.set_weight_budget(0)
+acl.rt.destroy_stream(stream)
+print('weight registry test passed')